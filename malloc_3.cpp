@@ -4,30 +4,89 @@
 #include <string.h>
 #include <sys/mman.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
-typedef struct MallocMetadata {
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000 //older kernels take it as a hint only - the returned address is checked anyway
+#endif
+
+typedef struct MallocMetadata { //small fields first, so the header packs into 48 bytes
     uint32_t cookie; 
+    bool is_free;
+    bool in_quick_list; //freed but not yet merged with its buddies
     void* addr;
     size_t size;
     size_t actual_size;
-    bool is_free;
     MallocMetadata* next;
     MallocMetadata* prev;
 } Metadata;
 
+static_assert(sizeof(Metadata) % 16 == 0, "blocks start 128 byte (or page) aligned, so this keeps payloads 16 byte aligned");
+
+static unsigned int cookie_seed = 1; //private generator state - srand() in the program can't change the cookie
+
 uint32_t generateRandomCookie() {
     uint32_t random_number = 0;
     for (int i = 0; i < 4; ++i) {
         random_number <<= 8; // Shift previous bits
-        random_number |= rand(); // OR with new random byte
+        random_number |= rand_r(&cookie_seed); // OR with new random byte
     }
     return random_number;
 }
 
+typedef struct MallocHeapChunk {
+    size_t length; //length of the whole mapping, starting at the chunk itself
+    void* bottom; //first top-order block, aligned to 128KB
+    size_t num_blocks; //number of top-order blocks starting at bottom
+    MallocHeapChunk* next;
+} Chunk;
+
+typedef struct MallocHeap {
+    Metadata* orders[11];
+    Metadata* quick_lists[11];
+    size_t quick_list_sizes[11];
+    Metadata* mmap_head;
+    Metadata* allocated_blocks;
+    Chunk* chunks; //mmap'd arenas owned by this heap - NULL for the global sbrk heap
+    void* unformatted; //next top-order block whose header wasn't written yet
+    void* arena_end; //end of the reserved but unformatted space
+    bool persistent; //lives in a file mapped by sheap_open - can't grow or mmap large blocks
+    void* root; //entry point to the heap's data structures, see sheap_set_root
+} Heap;
+
+typedef struct MallocPersistentHeader { //first 128KB of a file from sheap_open, blocks follow it
+    Heap heap; //must stay first - the heap handle is the mapping's base address
+    uint64_t magic;
+    uint32_t version;
+    uint32_t cookie; //cookie the block headers were written with
+    uint32_t clean; //0 while a process has the heap open
+    void* base; //blocks hold absolute pointers, so the file is always mapped here
+    size_t length;
+    Chunk chunk;
+    int lock_fd; //holds the file's flock while open - only meaningful in the process that opened it
+} PersistentHeader;
+
+static const uint64_t PERSISTENT_MAGIC = 0x334350414548534dULL; //"MSHEAPC3"
+static const uint64_t PERSISTENT_CREATING_MAGIC = 0x214350414548534dULL; //"MSHEAPC!" - set until the header is done
+static const uint32_t PERSISTENT_VERSION = 2; //2: 48 byte block headers
+
 static bool initialized = false;
-static Metadata* orders[11] = {NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL};
-static Metadata* mmap_head = NULL;
-static Metadata* allocated_blocks = NULL;
+static bool cookie_initialized = false;
+static bool configured = false; //set by smalloc_configure - the environment is ignored then
+static bool config_loaded = false; //set once the first heap is set up - the config is fixed from then on
+static const size_t DEFAULT_ARENA_SIZE = 32 * 128 * 1024;
+static size_t arena_size = DEFAULT_ARENA_SIZE; //initial sbrk() reservation, SMALLOC_ARENA_SIZE overrides it
+static bool prefault = false; //format and touch the whole arena up front, SMALLOC_PREFAULT=1 turns it on
+static bool huge_pages = false; //back the arena, chunks and large blocks with 2MB pages, SMALLOC_HUGEPAGES=1 turns it on
+static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+static Heap global_heap = {{NULL}, {NULL}, {0}, NULL, NULL, NULL, NULL, NULL, false, NULL};
+static const size_t QUICK_LIST_WATERMARK = 16; //freed blocks kept unmerged per order before a batch merge
 static uint32_t COOKIE = 0;
 
 void _validate_cookie(Metadata* metadata_ptr) {
@@ -45,52 +104,369 @@ void _align_program_break() {
     sbrk(diff);
 }
 
-void _init() {
-    if(initialized) {
+void _init_cookie() {
+    if(cookie_initialized) {
         return;
     }
     COOKIE = generateRandomCookie();
-    initialized = true;
-    _align_program_break();
-    void* curr_bottom = sbrk(32 * 128 * 1024); //allocate 32 * 128KB
-    Metadata* curr = NULL;
-    Metadata* last = NULL;
-    last = (Metadata*)curr_bottom;
-    last->cookie = COOKIE;
-    last->addr = (void*)((size_t)curr_bottom + sizeof(Metadata));
-    last->size = 128 * 1024;
-    last->actual_size = 0;
-    last->is_free = true;
-    last->next = NULL;
-    last->prev = NULL;
-    orders[10] = last;
-    curr_bottom = (void*)((size_t)curr_bottom + 128 * 1024);
-    for(int i = 1; i < 32; i++) {
-        curr = (Metadata*)curr_bottom;
+    cookie_initialized = true;
+}
+
+void _format_top_blocks(Heap* heap, void* bottom, int count) { //write 'count' free 128KB blocks starting at bottom and put them in front of orders[10]
+    void* curr_bottom = (void*)((size_t)bottom + (size_t)(count - 1) * 128 * 1024);
+    for(int i = 0; i < count; i++) {
+        Metadata* curr = (Metadata*)curr_bottom;
         curr->cookie = COOKIE;
         curr->addr = (void*)((size_t)curr_bottom + sizeof(Metadata));
         curr->size = 128 * 1024;
         curr->actual_size = 0;
         curr->is_free = true;
-        curr->next = NULL;
-        curr->prev = last;
-        last->next = curr;
-        last = curr;
-        curr = curr->next;
-        curr_bottom = (void*)((size_t)curr_bottom + 128 * 1024);
+        curr->in_quick_list = false;
+        curr->prev = NULL;
+        curr->next = heap->orders[10];
+        if(heap->orders[10] != NULL) {
+            heap->orders[10]->prev = curr;
+        }
+        heap->orders[10] = curr;
+        curr_bottom = (void*)((size_t)curr_bottom - 128 * 1024);
+    }
+}
+
+void _prefault(void* bottom, size_t length) { //fault in every page now instead of on first use
+    size_t page_size = getpagesize();
+    for(size_t offset = 0; offset < length; offset += page_size) {
+        *(volatile char*)((size_t)bottom + offset) = 0;
+    }
+}
+
+void _read_config_from_env() {
+    const char* size_env = getenv("SMALLOC_ARENA_SIZE");
+    if(size_env != NULL && strtoul(size_env, NULL, 0) > 0) {
+        arena_size = strtoul(size_env, NULL, 0);
+    }
+    const char* prefault_env = getenv("SMALLOC_PREFAULT");
+    if(prefault_env != NULL) {
+        prefault = strcmp(prefault_env, "1") == 0;
     }
+    const char* huge_pages_env = getenv("SMALLOC_HUGEPAGES");
+    if(huge_pages_env != NULL) {
+        huge_pages = strcmp(huge_pages_env, "1") == 0;
+    }
+}
+
+void _advise_huge_pages(void* bottom, size_t length) { //a hint only - without THP support the pages just stay 4KB
+#ifdef MADV_HUGEPAGE
+    if(huge_pages) {
+        madvise(bottom, length, MADV_HUGEPAGE);
+    }
+#endif
+}
+
+void* _map_huge_aligned(size_t length) { //transparent huge pages need a 2MB aligned address
+    void* ptr = mmap(NULL, length + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if(ptr == MAP_FAILED) {
+        return MAP_FAILED;
+    }
+    size_t aligned = ((size_t)ptr + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    size_t page_size = getpagesize();
+    size_t mapped_end = (size_t)ptr + ((length + HUGE_PAGE_SIZE + page_size - 1) & ~(page_size - 1));
+    size_t aligned_end = aligned + ((length + page_size - 1) & ~(page_size - 1));
+    if(aligned > (size_t)ptr) {
+        munmap(ptr, aligned - (size_t)ptr);
+    }
+    if(mapped_end > aligned_end) {
+        munmap((void*)aligned_end, mapped_end - aligned_end);
+    }
+    _advise_huge_pages((void*)aligned, length);
+    return (void*)aligned;
 }
 
-void _add_block_to_free_list(void* metadata_ptr, int order) {
+void* _map_large_block(size_t* length) { //'length' is the bytes needed, updated to the bytes actually mapped
+    if(huge_pages && *length >= HUGE_PAGE_SIZE) {
+#ifdef MAP_HUGETLB
+        size_t huge_length = (*length + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1); //hugetlb mappings are unmapped in whole pages
+        void* ptr = mmap(NULL, huge_length, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_HUGETLB, -1, 0);
+        if(ptr != MAP_FAILED) {
+            *length = huge_length;
+            return ptr;
+        }
+#endif
+        return _map_huge_aligned(*length); //no reserved hugetlb pages - fall back to transparent huge pages
+    }
+    return mmap(NULL, *length, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+}
+
+void _load_config() { //once, by whichever heap is set up first
+    if(config_loaded) {
+        return;
+    }
+    if(!configured) {
+        _read_config_from_env();
+    }
+    config_loaded = true;
+}
+
+void _init() {
+    if(initialized) {
+        return;
+    }
+    _init_cookie();
+    _load_config();
+    initialized = true;
+    size_t arena_alignment = huge_pages ? HUGE_PAGE_SIZE : 128 * 1024;
+    arena_size = (arena_size + arena_alignment - 1) & ~(arena_alignment - 1); //whole top-order blocks (and huge pages) only
+    _align_program_break();
+    void* curr_bottom = sbrk(arena_size);
+    if(curr_bottom == (void*)-1 && arena_size != DEFAULT_ARENA_SIZE) { //configured size is too big - use the default instead
+        arena_size = DEFAULT_ARENA_SIZE;
+        curr_bottom = sbrk(arena_size);
+    }
+    if(curr_bottom == (void*)-1) { //start with an empty arena - _grow_arena can still extend it
+        global_heap.unformatted = sbrk(0);
+        global_heap.arena_end = global_heap.unformatted;
+        return;
+    }
+    global_heap.unformatted = curr_bottom; //headers are written on demand by _format_next_top_block
+    global_heap.arena_end = (void*)((size_t)curr_bottom + arena_size);
+    _advise_huge_pages(curr_bottom, arena_size); //the break is aligned to 4MB, so the arena starts on a huge page
+    if(prefault) {
+        _prefault(curr_bottom, arena_size);
+        _format_top_blocks(&global_heap, curr_bottom, arena_size / (128 * 1024));
+        global_heap.unformatted = global_heap.arena_end;
+    }
+}
+
+bool _add_heap_chunk(Heap* heap) {
+    size_t alignment = huge_pages ? HUGE_PAGE_SIZE : 128 * 1024;
+    size_t length = 32 * 128 * 1024 + alignment; //spare room to align the blocks and hold the chunk header
+    void* ptr = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if(ptr == MAP_FAILED) {
+        return false;
+    }
+    Chunk* chunk = (Chunk*)ptr;
+    chunk->length = length;
+    chunk->bottom = (void*)(((size_t)ptr + sizeof(Chunk) + alignment - 1) & ~(alignment - 1)); //buddies are found by xor, so blocks must be aligned
+    chunk->num_blocks = 32;
+    _advise_huge_pages(chunk->bottom, 32 * 128 * 1024);
+    chunk->next = heap->chunks;
+    heap->chunks = chunk;
+    heap->unformatted = chunk->bottom;
+    heap->arena_end = (void*)((size_t)chunk->bottom + 32 * 128 * 1024);
+    if(prefault) { //after the advice, so the faults can be served with huge pages
+        _prefault(chunk->bottom, 32 * 128 * 1024);
+        _format_top_blocks(heap, chunk->bottom, 32);
+        heap->unformatted = heap->arena_end;
+    }
+    return true;
+}
+
+bool _grow_arena(Heap* heap) {
+    if(heap->persistent) { //the file has a fixed size
+        return false;
+    }
+    if(heap != &global_heap) {
+        return _add_heap_chunk(heap);
+    }
+    if(heap->arena_end == NULL || sbrk(0) != heap->arena_end) { //someone else moved the break - the arena can't stay contiguous
+        return false;
+    }
+    if(sbrk(128 * 1024) == (void*)-1) {
+        return false;
+    }
+    _advise_huge_pages(heap->arena_end, 128 * 1024); //collapsed into a huge page once the whole 2MB is advised
+    heap->arena_end = (void*)((size_t)heap->arena_end + 128 * 1024);
+    return true;
+}
+
+bool _format_next_top_block(Heap* heap) {
+    if(heap->unformatted == heap->arena_end && !_grow_arena(heap)) {
+        return false;
+    }
+    _format_top_blocks(heap, heap->unformatted, 1);
+    heap->unformatted = (void*)((size_t)heap->unformatted + 128 * 1024);
+    return true;
+}
+
+size_t _num_unformatted_blocks(Heap* heap) {
+    return ((size_t)heap->arena_end - (size_t)heap->unformatted) / (128 * 1024);
+}
+
+static const size_t VECTOR_COPY_THRESHOLD = 256; //below this libc's memmove / memset win
+static const size_t NON_TEMPORAL_THRESHOLD = 2 * 1024 * 1024; //bigger copies bypass the cache instead of flushing it
+
+#if defined(__x86_64__)
+/*
+ * Copy and clear kernels, one per instruction set, picked at runtime by _select_kernels.
+ * Copies run forward and load the head and tail vectors before the main loop, so they are safe for
+ * any dest <= src, which covers a block moving down into its merged buddy. n must be >= 2 vectors.
+ * Clears only ever see buddy blocks (mmap'd ones come zeroed), which stay far below
+ * NON_TEMPORAL_THRESHOLD, so they always store through the cache.
+ */
+void _copy_bytes_sse2(void* dest, const void* src, size_t n) {
+    size_t d = (size_t)dest;
+    size_t s = (size_t)src;
+    __m128i head = _mm_loadu_si128((const __m128i*)s);
+    __m128i tail = _mm_loadu_si128((const __m128i*)(s + n - 16));
+    size_t offset = 16 - (d & 15); //first offset with an aligned destination
+    size_t end = n - 16;
+    if(n >= NON_TEMPORAL_THRESHOLD) {
+        for(; offset < end; offset += 16) {
+            _mm_stream_si128((__m128i*)(d + offset), _mm_loadu_si128((const __m128i*)(s + offset)));
+        }
+        _mm_sfence();
+    }
+    else {
+        for(; offset < end; offset += 16) {
+            _mm_store_si128((__m128i*)(d + offset), _mm_loadu_si128((const __m128i*)(s + offset)));
+        }
+    }
+    _mm_storeu_si128((__m128i*)d, head);
+    _mm_storeu_si128((__m128i*)(d + n - 16), tail);
+}
+
+void _clear_bytes_sse2(void* dest, size_t n) {
+    size_t d = (size_t)dest;
+    __m128i zero = _mm_setzero_si128();
+    size_t offset = 16 - (d & 15);
+    size_t end = n - 16;
+    for(; offset < end; offset += 16) {
+        _mm_store_si128((__m128i*)(d + offset), zero);
+    }
+    _mm_storeu_si128((__m128i*)d, zero);
+    _mm_storeu_si128((__m128i*)(d + n - 16), zero);
+}
+
+__attribute__((target("avx2"))) void _copy_bytes_avx2(void* dest, const void* src, size_t n) {
+    size_t d = (size_t)dest;
+    size_t s = (size_t)src;
+    __m256i head = _mm256_loadu_si256((const __m256i*)s);
+    __m256i tail = _mm256_loadu_si256((const __m256i*)(s + n - 32));
+    size_t offset = 32 - (d & 31);
+    size_t end = n - 32;
+    if(n >= NON_TEMPORAL_THRESHOLD) {
+        for(; offset < end; offset += 32) {
+            _mm256_stream_si256((__m256i*)(d + offset), _mm256_loadu_si256((const __m256i*)(s + offset)));
+        }
+        _mm_sfence();
+    }
+    else {
+        for(; offset < end; offset += 32) {
+            _mm256_store_si256((__m256i*)(d + offset), _mm256_loadu_si256((const __m256i*)(s + offset)));
+        }
+    }
+    _mm256_storeu_si256((__m256i*)d, head);
+    _mm256_storeu_si256((__m256i*)(d + n - 32), tail);
+    _mm256_zeroupper();
+}
+
+__attribute__((target("avx2"))) void _clear_bytes_avx2(void* dest, size_t n) {
+    size_t d = (size_t)dest;
+    __m256i zero = _mm256_setzero_si256();
+    size_t offset = 32 - (d & 31);
+    size_t end = n - 32;
+    for(; offset < end; offset += 32) {
+        _mm256_store_si256((__m256i*)(d + offset), zero);
+    }
+    _mm256_storeu_si256((__m256i*)d, zero);
+    _mm256_storeu_si256((__m256i*)(d + n - 32), zero);
+    _mm256_zeroupper();
+}
+
+__attribute__((target("avx512f"))) void _copy_bytes_avx512(void* dest, const void* src, size_t n) {
+    size_t d = (size_t)dest;
+    size_t s = (size_t)src;
+    __m512i head = _mm512_loadu_si512((const void*)s);
+    __m512i tail = _mm512_loadu_si512((const void*)(s + n - 64));
+    size_t offset = 64 - (d & 63);
+    size_t end = n - 64;
+    if(n >= NON_TEMPORAL_THRESHOLD) {
+        for(; offset < end; offset += 64) {
+            _mm512_stream_si512((__m512i*)(d + offset), _mm512_loadu_si512((const void*)(s + offset)));
+        }
+        _mm_sfence();
+    }
+    else {
+        for(; offset < end; offset += 64) {
+            _mm512_store_si512((void*)(d + offset), _mm512_loadu_si512((const void*)(s + offset)));
+        }
+    }
+    _mm512_storeu_si512((void*)d, head);
+    _mm512_storeu_si512((void*)(d + n - 64), tail);
+    _mm256_zeroupper();
+}
+
+__attribute__((target("avx512f"))) void _clear_bytes_avx512(void* dest, size_t n) {
+    size_t d = (size_t)dest;
+    __m512i zero = _mm512_setzero_si512();
+    size_t offset = 64 - (d & 63);
+    size_t end = n - 64;
+    for(; offset < end; offset += 64) {
+        _mm512_store_si512((void*)(d + offset), zero);
+    }
+    _mm512_storeu_si512((void*)d, zero);
+    _mm512_storeu_si512((void*)(d + n - 64), zero);
+    _mm256_zeroupper();
+}
+
+static void (*copy_kernel)(void*, const void*, size_t) = NULL;
+static void (*clear_kernel)(void*, size_t) = NULL;
+
+void _select_kernels() {
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f")) {
+        copy_kernel = _copy_bytes_avx512;
+        clear_kernel = _clear_bytes_avx512;
+    }
+    else if(__builtin_cpu_supports("avx2")) {
+        copy_kernel = _copy_bytes_avx2;
+        clear_kernel = _clear_bytes_avx2;
+    }
+    else { //every x86_64 cpu has sse2
+        copy_kernel = _copy_bytes_sse2;
+        clear_kernel = _clear_bytes_sse2;
+    }
+}
+#endif
+
+void _copy_bytes(void* dest, const void* src, size_t n) { //memmove for relocations - dest must not overlap src from above
+    if(dest == src || n == 0) {
+        return;
+    }
+#if defined(__x86_64__)
+    if(n >= VECTOR_COPY_THRESHOLD && ((size_t)dest < (size_t)src || (size_t)dest >= (size_t)src + n)) {
+        if(copy_kernel == NULL) {
+            _select_kernels();
+        }
+        copy_kernel(dest, src, n);
+        return;
+    }
+#endif
+    memmove(dest, src, n);
+}
+
+void _clear_bytes(void* dest, size_t n) {
+#if defined(__x86_64__)
+    if(n >= VECTOR_COPY_THRESHOLD) {
+        if(clear_kernel == NULL) {
+            _select_kernels();
+        }
+        clear_kernel(dest, n);
+        return;
+    }
+#endif
+    memset(dest, 0, n);
+}
+
+void _add_block_to_free_list(Heap* heap, void* metadata_ptr, int order) {
     Metadata* curr = (Metadata*)metadata_ptr;
     _validate_cookie(curr);
-    if(orders[order] == NULL) {
-        orders[order] = curr;
+    if(heap->orders[order] == NULL) {
+        heap->orders[order] = curr;
         curr->next = NULL;
         curr->prev = NULL;
     }
     else {
-        Metadata* last = orders[order];
+        Metadata* last = heap->orders[order];
         while(last->next != NULL && last->next->addr < curr->addr) {
             _validate_cookie(last);
             last = last->next;
@@ -109,7 +485,7 @@ void _add_block_to_free_list(void* metadata_ptr, int order) {
     }
 }
 
-void _trim_if_large_enough(void* metadata_ptr, size_t actual_size,  int order) {
+void _trim_if_large_enough(Heap* heap, void* metadata_ptr, size_t actual_size,  int order) {
     Metadata* curr = (Metadata*)metadata_ptr;
     _validate_cookie(curr);
     int curr_order = order;
@@ -123,27 +499,28 @@ void _trim_if_large_enough(void* metadata_ptr, size_t actual_size,  int order) {
         new_block->addr = (void*)((size_t)new_block + sizeof(Metadata));
         new_block->size = pow(2, curr_order) * 128;
         new_block->is_free = true;
+        new_block->in_quick_list = false;
         new_block->next = NULL;
         new_block->prev = NULL;
-        _add_block_to_free_list((void*)new_block, curr_order);
+        _add_block_to_free_list(heap, (void*)new_block, curr_order);
         curr->size = pow(2, curr_order) * 128;
     }
 }
 
-void _remove_from_list(void* metadata_ptr, int order) {
+void _remove_from_list(Heap* heap, void* metadata_ptr, int order) {
     Metadata* curr = (Metadata*)metadata_ptr;
     _validate_cookie(curr);
     Metadata* prev = curr->prev;
     Metadata* next = curr->next;
     if(prev == NULL && next == NULL) {
-        orders[order] = NULL;
+        heap->orders[order] = NULL;
     }
     else {
         if(prev != NULL) {
             prev->next = next;
         }
         else {
-            orders[order] = next;
+            heap->orders[order] = next;
         }
         if(next != NULL) {
             next->prev = prev;
@@ -151,23 +528,23 @@ void _remove_from_list(void* metadata_ptr, int order) {
     }
 }
 
-void _merge_buddy_blocks(void* metadata_ptr, int order) {
+void _merge_buddy_blocks(Heap* heap, void* metadata_ptr, int order) {
     Metadata* curr = (Metadata*)metadata_ptr;
     _validate_cookie(curr);
     int curr_order = order;
+    if(curr_order >= 10) { //top-order blocks have no buddy - it may lie outside the chunk
+        _add_block_to_free_list(heap, (void*)curr, curr_order);
+        return;
+    }
     Metadata* buddy = (Metadata*)((size_t)curr ^ curr->size);
     _validate_cookie(buddy);
     Metadata* last = NULL;
-    if(curr_order >= 10) {
-        _add_block_to_free_list((void*)curr, curr_order);
+    if(buddy == NULL || !buddy->is_free || buddy->in_quick_list || buddy->size != curr->size) {
+        _add_block_to_free_list(heap, (void*)curr, curr_order);
         return;
     }
-    if(buddy == NULL || !buddy->is_free || buddy->size != curr->size) {
-        _add_block_to_free_list((void*)curr, curr_order);
-        return;
-    }
-    //_remove_from_list((void*)curr, curr_order);
-    _remove_from_list((void*)buddy, curr_order);
+    //_remove_from_list(heap, (void*)curr, curr_order);
+    _remove_from_list(heap, (void*)buddy, curr_order);
     if(curr->addr < buddy->addr) {
         curr_order++;
         curr->size *= 2;
@@ -178,24 +555,77 @@ void _merge_buddy_blocks(void* metadata_ptr, int order) {
         buddy->size *= 2;
         last = buddy;
     }
-    _merge_buddy_blocks((void*)last, curr_order);
+    _merge_buddy_blocks(heap, (void*)last, curr_order);
+}
+
+void _add_block_to_quick_list(Heap* heap, void* metadata_ptr, int order) {
+    Metadata* curr = (Metadata*)metadata_ptr;
+    _validate_cookie(curr);
+    curr->in_quick_list = true;
+    curr->prev = NULL;
+    curr->next = heap->quick_lists[order];
+    if(heap->quick_lists[order] != NULL) {
+        heap->quick_lists[order]->prev = curr;
+    }
+    heap->quick_lists[order] = curr;
+    heap->quick_list_sizes[order]++;
+}
+
+Metadata* _pop_quick_list(Heap* heap, int order) {
+    Metadata* curr = heap->quick_lists[order];
+    if(curr == NULL) {
+        return NULL;
+    }
+    _validate_cookie(curr);
+    heap->quick_lists[order] = curr->next;
+    if(curr->next != NULL) {
+        curr->next->prev = NULL;
+    }
+    heap->quick_list_sizes[order]--;
+    curr->in_quick_list = false;
+    curr->next = NULL;
+    curr->prev = NULL;
+    return curr;
+}
+
+void _flush_quick_list(Heap* heap, int order) { //merge every deferred block of this order with its buddies
+    Metadata* curr = _pop_quick_list(heap, order);
+    while(curr != NULL) {
+        _merge_buddy_blocks(heap, (void*)curr, order);
+        curr = _pop_quick_list(heap, order);
+    }
+}
+
+void _flush_quick_lists(Heap* heap) {
+    for(int i = 0; i < 11; i++) {
+        _flush_quick_list(heap, i);
+    }
+}
+
+void _add_to_allocated_list(Heap* heap, Metadata* curr) {
+    curr->prev = NULL;
+    curr->next = heap->allocated_blocks;
+    if(heap->allocated_blocks != NULL) {
+        heap->allocated_blocks->prev = curr;
+    }
+    heap->allocated_blocks = curr;
 }
 
 int _order(size_t size) {
-    if(size/128 < 1) {
+    if(size <= 128) {
         return 0;
     }
-    return ceil(log2(size/128));
+    return ceil(log2((double)size / 128)); //round up - a partial 128 byte unit still needs the next order
 }
 
 int _srealloc_buddy_check(Metadata* curr, size_t size, size_t curr_block_size, int curr_order, bool* resizable) {
-    if(curr == NULL) {
+    if(curr == NULL || curr_order >= 10) { //can't grow past a top-order block
         *resizable = false;
         return -1;
     }
     _validate_cookie(curr);
     Metadata* buddy = (Metadata*)(((size_t)curr->addr - sizeof(Metadata)) ^ curr_block_size);
-    if(buddy == NULL || !buddy->is_free || buddy->size != curr_block_size) {
+    if(buddy == NULL || !buddy->is_free || buddy->in_quick_list || buddy->size != curr_block_size) {
         *resizable = false;
         return -1;
     }
@@ -213,7 +643,7 @@ int _srealloc_buddy_check(Metadata* curr, size_t size, size_t curr_block_size, i
     return -1; //won't reach
 }
 
-void* _srealloc_buddy_resize(void* metadata_ptr, int order, int max_order) {
+void* _srealloc_buddy_resize(Heap* heap, void* metadata_ptr, int order, int max_order) {
     Metadata* curr = (Metadata*)metadata_ptr;
     _validate_cookie(curr);
     int curr_order = order;
@@ -223,7 +653,7 @@ void* _srealloc_buddy_resize(void* metadata_ptr, int order, int max_order) {
     if(curr_order == max_order + 1) {
         return (void*)curr;
     }
-    _remove_from_list((void*)buddy, curr_order);
+    _remove_from_list(heap, (void*)buddy, curr_order);
     if(curr->addr < buddy->addr) {
         curr->size *= 2;
         last = curr;
@@ -233,61 +663,15 @@ void* _srealloc_buddy_resize(void* metadata_ptr, int order, int max_order) {
         buddy->actual_size = curr->actual_size;
         last = buddy;
     }
-    return _srealloc_buddy_resize((void*)last, order + 1, max_order);
+    return _srealloc_buddy_resize(heap, (void*)last, order + 1, max_order);
 }
 
-/**
- * @brief Searches for a free block with at least ‘size’ bytes or allocates (sbrk()) one if none are
-            found.
- * 
- * @param size The size of the block to allocate.
- * @return void* 
- *          Success – returns pointer to the first byte in the allocated block (excluding the meta-data of
-                        course)
-            ii. Failure –
-            a. If size is 0 returns NULL.
-            b. If ‘size’ is more than 10^8, return NULL.
-            c. If sbrk fails in allocating the needed space, return NULL. 
-
- */
-void* smalloc(size_t size) {
-    _init(); //initialize first 32 blocks of 128KB
-    if(size == 0 || size > pow(10, 8)) {
-        return NULL;
-    }
-    if(size + sizeof(Metadata) >= 128 * 1024) { //use mmap
-        void* ptr = mmap(NULL, size + sizeof(Metadata), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-        if(ptr == MAP_FAILED) {
-            return NULL;
-        }
-        Metadata* new_block = (Metadata*)ptr;
-        new_block->cookie = COOKIE;
-        new_block->addr = (void*)((size_t)ptr + sizeof(Metadata));
-        new_block->size = size + sizeof(Metadata);
-        new_block->actual_size = size;
-        new_block->is_free = false;
-        new_block->next = NULL;
-        new_block->prev = NULL;
-        if(mmap_head == NULL) {
-            mmap_head = new_block;
-        }
-        else {
-            Metadata* last = mmap_head;
-            while(last->next != NULL) {
-                _validate_cookie(last);
-                last = last->next;
-            }
-            last->next = new_block;
-            new_block->prev = last;
-        }
-        return new_block->addr;
-    }
-    int order = _order(size + sizeof(Metadata));
+Metadata* _find_free_block(Heap* heap, size_t size, int order) {
     for(int i = order; i < 11; i++) { //find lowest order with free blocks that fits
-        if(orders[i] == NULL) {
+        if(heap->orders[i] == NULL) {
             continue;
         }
-        Metadata* curr = orders[i];
+        Metadata* curr = heap->orders[i];
         while(curr != NULL) { //find free block - first one should be free (might remove while later) - not removing, I'm scared
             _validate_cookie(curr);
             if(curr->is_free) {
@@ -296,35 +680,21 @@ void* smalloc(size_t size) {
                 Metadata* prev = curr->prev;
                 Metadata* next = curr->next;
                 if(prev == NULL && next == NULL) {
-                    orders[i] = NULL;
+                    heap->orders[i] = NULL;
                 }
                 else {
                     if(prev != NULL) {
                         prev->next = next;
                     }
                     else {
-                        orders[i] = next;
+                        heap->orders[i] = next;
                     }
                     if(next != NULL) {
                         next->prev = prev;
                     }
                 }
-                _trim_if_large_enough((void*)curr, size + sizeof(Metadata), i);
-                if(allocated_blocks == NULL) { //add to used blocks list
-                    allocated_blocks = curr;
-                    curr->prev = NULL;
-                    curr->next = NULL;
-                }
-                else {
-                    Metadata* last = allocated_blocks;
-                    while(last->next != NULL) {
-                        last = last->next;
-                    }
-                    last->next = curr;
-                    curr->prev = last;
-                    curr->next = NULL;
-                }
-                return curr->addr;
+                _trim_if_large_enough(heap, (void*)curr, size + sizeof(Metadata), i);
+                return curr;
             }
             curr = curr->next;
         }
@@ -332,6 +702,110 @@ void* smalloc(size_t size) {
     return NULL;
 }
 
+void* _smalloc(Heap* heap, size_t size) {
+    if(size == 0 || size > pow(10, 8)) {
+        return NULL;
+    }
+    if(size + sizeof(Metadata) > 128 * 1024) { //use mmap - same test as sfree/srealloc, an exact 128KB fits a top-order block
+        if(heap->persistent) { //an anonymous mapping wouldn't survive a restart
+            return NULL;
+        }
+        size_t length = size + sizeof(Metadata);
+        void* ptr = _map_large_block(&length);
+        if(ptr == MAP_FAILED) {
+            return NULL;
+        }
+        Metadata* new_block = (Metadata*)ptr;
+        new_block->cookie = COOKIE;
+        new_block->addr = (void*)((size_t)ptr + sizeof(Metadata));
+        new_block->size = length;
+        new_block->actual_size = size;
+        new_block->is_free = false;
+        new_block->in_quick_list = false;
+        new_block->next = NULL;
+        new_block->prev = NULL;
+        if(heap->mmap_head == NULL) {
+            heap->mmap_head = new_block;
+        }
+        else {
+            Metadata* last = heap->mmap_head;
+            while(last->next != NULL) {
+                _validate_cookie(last);
+                last = last->next;
+            }
+            last->next = new_block;
+            new_block->prev = last;
+        }
+        return new_block->addr;
+    }
+    int order = _order(size + sizeof(Metadata));
+    Metadata* quick = _pop_quick_list(heap, order); //recently freed block of the exact order - no split needed
+    if(quick != NULL) {
+        quick->is_free = false;
+        quick->actual_size = size;
+        _add_to_allocated_list(heap, quick);
+        return quick->addr;
+    }
+    Metadata* curr = _find_free_block(heap, size, order);
+    if(curr == NULL) { //a larger order ran dry - merge the deferred blocks and look again
+        _flush_quick_lists(heap);
+        curr = _find_free_block(heap, size, order);
+    }
+    if(curr == NULL && _format_next_top_block(heap)) { //take a fresh top-order block from the arena
+        curr = _find_free_block(heap, size, order);
+    }
+    if(curr == NULL) {
+        return NULL;
+    }
+    _add_to_allocated_list(heap, curr); //add to used blocks list
+    return curr->addr;
+}
+
+/**
+ * @brief Configures all heaps. Must be called before the first smalloc(), sheap_create() or sheap_open(), and takes precedence
+            over the SMALLOC_ARENA_SIZE, SMALLOC_PREFAULT and SMALLOC_HUGEPAGES environment variables.
+ * 
+ * @param initial_arena_size The number of bytes reserved with sbrk() up front, rounded up to 128KB.
+            The arena still grows by 128KB at a time while nothing else moves the program break.
+            If sbrk() can't reserve this much, the default 32 * 128KB is tried, then an empty arena.
+ * @param prefault_arena If true, the whole arena (and every sheap chunk) is faulted in and formatted up front,
+            trading a slower start for steady latency. Otherwise top-order blocks are formatted on first use.
+ * @param huge_pages_arena If true, the arena, sheap chunks and mmap'd blocks of 2MB or more are backed by 2MB pages:
+            MAP_HUGETLB when the system has reserved huge pages, otherwise 2MB aligned mappings with MADV_HUGEPAGE.
+ * @return bool 
+ *          i. Success – true.
+            ii. Failure – false if any heap was already set up or ‘initial_arena_size’ is 0.
+ */
+bool smalloc_configure(size_t initial_arena_size, bool prefault_arena, bool huge_pages_arena) {
+    if(config_loaded || initial_arena_size == 0) {
+        return false;
+    }
+    arena_size = initial_arena_size;
+    prefault = prefault_arena;
+    huge_pages = huge_pages_arena;
+    configured = true;
+    return true;
+}
+
+/**
+ * @brief Searches for a free block with at least ‘size’ bytes or allocates (sbrk()) one if none are
+            found.
+ * 
+ * @param size The size of the block to allocate.
+ * @return void* 
+ *          Success – returns pointer to the first byte in the allocated block (excluding the meta-data of
+                        course)
+            ii. Failure –
+            a. If size is 0 returns NULL.
+            b. If ‘size’ is more than 10^8, return NULL.
+            c. If sbrk fails in allocating the needed space, return NULL. 
+
+ */
+void* smalloc(size_t size) {
+    _init(); //reserve the arena - top-order blocks are formatted as they are needed
+    return _smalloc(&global_heap, size);
+}
+
 /**
  * @brief Searches for a free block of at least ‘num’ elements, each ‘size’ bytes that are all set to 0
             or allocates if none are found. In other words, find/allocate size * num bytes and set all
@@ -350,24 +824,20 @@ void* scalloc(size_t num, size_t size) {
     if(num == 0 || size == 0 || num * size > pow(10, 8)) {
         return NULL;
     }
-    Metadata* ptr = (Metadata*)((size_t)smalloc(num * size) - sizeof(Metadata));
-    if(ptr == NULL) {
+    void* new_ptr = smalloc(num * size);
+    if(new_ptr == NULL) {
         return NULL;
     }
+    Metadata* ptr = (Metadata*)((size_t)new_ptr - sizeof(Metadata));
     _validate_cookie(ptr);
-    memset((void*)((size_t)ptr + sizeof(Metadata)), 0, num * size);
-    return (void*)((size_t)ptr + sizeof(Metadata));
+    if(ptr->size > 128 * 1024) { //fresh anonymous mmap - the kernel already zeroed it
+        return new_ptr;
+    }
+    _clear_bytes(new_ptr, num * size);
+    return new_ptr;
 }
 
-/**
- * @brief Releases the usage of the block that starts with the pointer ‘p’.
- * 
- * @param p The pointer to the block to release.
- * @return void* 
- *          If ‘p’ is NULL or already released, simply returns.
-            Presume that all pointers ‘p’ truly points to the beginning of an allocated block.
- */
-void* sfree(void* p) {
+void* _sfree(Heap* heap, void* p) {
     if(p == NULL) {
         return NULL;
     }
@@ -381,18 +851,18 @@ void* sfree(void* p) {
         Metadata* next = curr->next;
         _validate_cookie(prev);
         _validate_cookie(next);
-        if(munmap(curr, curr->size + sizeof(Metadata)) == -1) {
+        if(munmap(curr, curr->size) == -1) { //size already includes the metadata
             return NULL;
         }
         if(prev == NULL && next == NULL) {
-            mmap_head = NULL;
+            heap->mmap_head = NULL;
         }
         else {
             if(prev != NULL) {
                 prev->next = next;
             }
             else {
-                mmap_head = next;
+                heap->mmap_head = next;
             }
             if(next != NULL) {
                 next->prev = prev;
@@ -408,28 +878,46 @@ void* sfree(void* p) {
         _validate_cookie(prev);
         _validate_cookie(next);
         if(prev == NULL && next == NULL) {
-            allocated_blocks = NULL;
+            heap->allocated_blocks = NULL;
         }
         else {
             if(prev != NULL) {
                 prev->next = next;
             }
             else {
-                allocated_blocks = next;
+                heap->allocated_blocks = next;
             }
             if(next != NULL) {
                 next->prev = prev;
             }
         }
-        _merge_buddy_blocks(curr, _order(curr->size));
+        int order = _order(curr->size);
+        _add_block_to_quick_list(heap, (void*)curr, order); //defer merging - a same sized smalloc reuses it as is
+        if(heap->quick_list_sizes[order] > QUICK_LIST_WATERMARK) {
+            _flush_quick_list(heap, order);
+        }
     }
     return NULL;
 }
 
+/**
+ * @brief Releases the usage of the block that starts with the pointer ‘p’.
+ * 
+ * @param p The pointer to the block to release.
+ * @return void* 
+ *          If ‘p’ is NULL or already released, simply returns.
+            Presume that all pointers ‘p’ truly points to the beginning of an allocated block.
+ */
+void* sfree(void* p) {
+    return _sfree(&global_heap, p);
+}
+
 /**
  * @brief If ‘size’ is smaller than or equal to the current block’s size, reuses the same block.
             Otherwise, finds/allocates ‘size’ bytes for a new space, copies content of oldp into the
             new allocated space and frees the oldp.
+            When shrinking, the unused tail is released: buddy blocks are split down to the smallest
+            fitting order and mmap'd blocks give their tail pages back to the OS.
 
  * 
  * @param oldp The pointer to the block to reallocate.
@@ -445,6 +933,7 @@ void* sfree(void* p) {
                 d. Do not free ‘oldp’ if srealloc() fails. 
  */
 void* srealloc(void* oldp, size_t size) {
+    Heap* heap = &global_heap;
     if(size == 0 || size > pow(10, 8)) {
         return NULL;
     }
@@ -458,18 +947,41 @@ void* srealloc(void* oldp, size_t size) {
         if(size == curr->actual_size) { //reuse same block
             return oldp;
         }
+        if(size < curr->actual_size) { //shrink
+            if(size + sizeof(Metadata) > 128 * 1024) { //still mmap sized - release the tail pages in place
+                size_t new_length = size + sizeof(Metadata);
+                if(huge_pages && curr->size >= HUGE_PAGE_SIZE) { //release whole huge pages only - splitting one demotes it to 4KB pages
+                    new_length = (new_length + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+                }
+                curr->actual_size = size;
+                if(new_length < curr->size && mremap(curr, curr->size, new_length, 0) != MAP_FAILED) { //on failure the block is untouched, keep using it as is
+                    curr->size = new_length;
+                }
+                return oldp;
+            }
+            void* new_ptr = smalloc(size); //small enough for the buddy allocator - move and unmap
+            if(new_ptr == NULL) {
+                return NULL;
+            }
+            _copy_bytes(new_ptr, oldp, size);
+            sfree(oldp);
+            return new_ptr;
+        }
         void* new_ptr = smalloc(size);
         if(new_ptr == NULL) {
             return NULL;
         }
         _validate_cookie(curr);
-        memmove(new_ptr, oldp, curr->size);
+        _copy_bytes(new_ptr, oldp, curr->actual_size); //live bytes only
+        sfree(oldp);
         return new_ptr;
     }
-    if(size <= curr->size - sizeof(Metadata)) { //reuse same block
+    if(size <= curr->size - sizeof(Metadata)) { //reuse same block - give the unused halves back to the free lists
         curr->actual_size = size;
+        _trim_if_large_enough(heap, (void*)curr, size + sizeof(Metadata), _order(curr->size));
         return oldp;
     }
+    size_t live_size = curr->actual_size; //the old header may be overwritten once buddies merge
     bool resizable;
     int new_order = _srealloc_buddy_check(curr, size, curr->size, _order(curr->size), &resizable); //check if we can use buddies
     void* new_ptr;
@@ -479,7 +991,7 @@ void* srealloc(void* oldp, size_t size) {
             return NULL;
         }
         Metadata* new_meta = (Metadata*)((size_t)new_ptr - sizeof(Metadata));
-        memmove((void*)((size_t)new_meta + sizeof(Metadata)), oldp, ((Metadata*)((size_t)oldp - sizeof(Metadata)))->size - sizeof(Metadata));
+        _copy_bytes((void*)((size_t)new_meta + sizeof(Metadata)), oldp, curr->actual_size); //live bytes only
         sfree(oldp);
         return (void*)((size_t)new_meta + sizeof(Metadata));
     }
@@ -489,29 +1001,29 @@ void* srealloc(void* oldp, size_t size) {
         _validate_cookie(prev);
         _validate_cookie(next);
         if(prev == NULL && next == NULL) {
-            allocated_blocks = NULL;
+            heap->allocated_blocks = NULL;
         }
         else {
             if(prev != NULL) {
                 prev->next = next;
             }
             else {
-                allocated_blocks = next;
+                heap->allocated_blocks = next;
             }
             if(next != NULL) {
                 next->prev = prev;
             }
         }
-        new_ptr = _srealloc_buddy_resize(curr, _order(curr->size), new_order);
+        new_ptr = _srealloc_buddy_resize(heap, curr, _order(curr->size), new_order);
     }
     Metadata* new_meta = (Metadata*)new_ptr;
     if(new_meta == NULL) {
         return NULL;
     }
     _validate_cookie(new_meta);
-    Metadata* last = allocated_blocks;
+    Metadata* last = heap->allocated_blocks;
     if(last == NULL) {
-        allocated_blocks = new_meta;
+        heap->allocated_blocks = new_meta;
     }
     else {
         while(last != NULL && last->next != NULL) {
@@ -522,27 +1034,393 @@ void* srealloc(void* oldp, size_t size) {
     new_meta->prev = last;
     new_meta->next = NULL;
     new_meta->is_free = false;
-    memmove((void*)((size_t)new_meta + sizeof(Metadata)), oldp, ((Metadata*)((size_t)oldp - sizeof(Metadata)))->size - sizeof(Metadata));
+    new_meta->actual_size = size;
+    _copy_bytes((void*)((size_t)new_meta + sizeof(Metadata)), oldp, live_size); //moves down or stays - never overlaps from above
     return (void*)((size_t)new_meta + sizeof(Metadata));
 }
 
+void _release_mmap_blocks(Heap* heap) {
+    Metadata* curr = heap->mmap_head;
+    while(curr != NULL) {
+        _validate_cookie(curr);
+        Metadata* next = curr->next;
+        munmap(curr, curr->size);
+        curr = next;
+    }
+    heap->mmap_head = NULL;
+}
+
+/**
+ * @brief Creates an independent heap that owns its own buddy chunks (mmap'd 32 * 128KB at a time)
+            and free lists. Blocks of different heaps never merge with each other.
+ * 
+ * @return Heap* 
+ *          i. Success – a handle for the other sheap_* functions.
+            ii. Failure – if mmap fails, return NULL.
+ */
+Heap* sheap_create() {
+    _init_cookie();
+    _load_config();
+    Heap* heap = (Heap*)mmap(NULL, sizeof(Heap), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if(heap == MAP_FAILED) {
+        return NULL;
+    }
+    memset(heap, 0, sizeof(Heap));
+    if(!_add_heap_chunk(heap)) {
+        munmap(heap, sizeof(Heap));
+        return NULL;
+    }
+    return heap;
+}
+
+/**
+ * @brief Same as smalloc(), but allocates from ‘heap’. When all of the heap's chunks are in use,
+            another chunk is mapped.
+ * 
+ * @param heap The heap to allocate from.
+ * @param size The size of the block to allocate.
+ * @return void* 
+ *          i. Success – returns pointer to the first byte in the allocated block.
+            ii. Failure – if ‘heap’ is NULL, or for the same reasons as smalloc(), return NULL.
+ */
+void* sheap_malloc(Heap* heap, size_t size) {
+    if(heap == NULL) {
+        return NULL;
+    }
+    return _smalloc(heap, size);
+}
+
+/**
+ * @brief Same as sfree(), for a block that was allocated from ‘heap’.
+ * 
+ * @param heap The heap ‘p’ was allocated from.
+ * @param p The pointer to the block to release.
+ */
+void* sheap_free(Heap* heap, void* p) {
+    if(heap == NULL) {
+        return NULL;
+    }
+    return _sfree(heap, p);
+}
+
+/**
+ * @brief Releases every block allocated from ‘heap’ at once. The heap keeps its chunks, which
+            become free top-order blocks again, so it can be reused right away.
+            Costs O(number of chunks + number of mmap'd blocks), regardless of how many blocks were allocated.
+ * 
+ * @param heap The heap to reset.
+ */
+void sheap_reset(Heap* heap) {
+    if(heap == NULL) {
+        return;
+    }
+    _release_mmap_blocks(heap);
+    for(int i = 0; i < 11; i++) {
+        heap->orders[i] = NULL;
+        heap->quick_lists[i] = NULL;
+        heap->quick_list_sizes[i] = 0;
+    }
+    heap->allocated_blocks = NULL;
+    heap->root = NULL;
+    Chunk* chunk = heap->chunks;
+    if(chunk != NULL) { //the newest chunk is formatted lazily again
+        heap->unformatted = chunk->bottom;
+        heap->arena_end = (void*)((size_t)chunk->bottom + chunk->num_blocks * 128 * 1024);
+        chunk = chunk->next;
+    }
+    while(chunk != NULL) {
+        _format_top_blocks(heap, chunk->bottom, chunk->num_blocks);
+        chunk = chunk->next;
+    }
+}
+
+/**
+ * @brief Releases every block allocated from ‘heap’ and unmaps all of its chunks and the heap itself.
+            The handle must not be used afterwards.
+            A heap from sheap_open() is only detached: it is flushed, marked clean and unmapped, its file
+            is unlocked, and the file keeps the data for the next sheap_open().
+ * 
+ * @param heap The heap to destroy.
+ */
+void sheap_destroy(Heap* heap) {
+    if(heap == NULL) {
+        return;
+    }
+    if(heap->persistent) {
+        PersistentHeader* header = (PersistentHeader*)heap;
+        size_t length = header->length;
+        int fd = header->lock_fd;
+        msync(header, length, MS_SYNC); //data and block headers first, so 'clean' is never ahead of them
+        header->clean = 1;
+        msync(header, 128 * 1024, MS_SYNC);
+        munmap(header, length);
+        flock(fd, LOCK_UN);
+        close(fd);
+        return;
+    }
+    _release_mmap_blocks(heap);
+    Chunk* chunk = heap->chunks;
+    while(chunk != NULL) {
+        Chunk* next = chunk->next;
+        munmap(chunk, chunk->length);
+        chunk = next;
+    }
+    munmap(heap, sizeof(Heap));
+}
+
+bool _valid_block_header(Metadata* curr, uint32_t file_cookie, size_t end) {
+    if(curr->cookie != file_cookie && curr->cookie != COOKIE) {
+        return false;
+    }
+    size_t size = curr->size;
+    if(size < 128 || size > 128 * 1024 || (size & (size - 1)) != 0) { //buddy blocks are powers of two
+        return false;
+    }
+    return ((size_t)curr & (size - 1)) == 0 && (size_t)curr + size <= end;
+}
+
+void _rebuild_add_free_block(Heap* heap, Metadata* curr, int order, Metadata** tails) {
+    while(order < 10) { //blocks arrive in address order, so a free left buddy is always the tail of its list
+        Metadata* buddy = (Metadata*)((size_t)curr ^ curr->size);
+        if(buddy > curr || !buddy->is_free || buddy->size != curr->size) { //right buddies aren't reached yet
+            break;
+        }
+        tails[order] = buddy->prev;
+        _remove_from_list(heap, (void*)buddy, order);
+        buddy->size *= 2;
+        curr = buddy;
+        order++;
+    }
+    curr->next = NULL;
+    curr->prev = tails[order];
+    if(tails[order] == NULL) {
+        heap->orders[order] = curr;
+    }
+    else {
+        tails[order]->next = curr;
+    }
+    tails[order] = curr;
+}
+
+bool _rebuild_persistent_heap(Heap* heap, uint32_t file_cookie) { //rebuild every list from the block headers alone
+    for(int i = 0; i < 11; i++) {
+        heap->orders[i] = NULL;
+        heap->quick_lists[i] = NULL;
+        heap->quick_list_sizes[i] = 0;
+    }
+    heap->allocated_blocks = NULL;
+    size_t bottom = (size_t)heap->chunks->bottom;
+    size_t end = (size_t)heap->unformatted;
+    for(size_t curr_addr = bottom; curr_addr < end; curr_addr += ((Metadata*)curr_addr)->size) { //validate and restamp
+        Metadata* curr = (Metadata*)curr_addr;
+        if(!_valid_block_header(curr, file_cookie, end)) {
+            return false;
+        }
+        curr->cookie = COOKIE;
+        curr->addr = (void*)(curr_addr + sizeof(Metadata));
+        curr->in_quick_list = false;
+    }
+    Metadata* tails[11] = {NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL};
+    size_t curr_addr = bottom;
+    while(curr_addr < end) { //in address order, so each pair of buddies merges when the right one is reached
+        Metadata* curr = (Metadata*)curr_addr;
+        size_t size = curr->size;
+        if(curr->is_free) {
+            _rebuild_add_free_block(heap, curr, _order(size), tails);
+        }
+        else {
+            _add_to_allocated_list(heap, curr);
+        }
+        curr_addr += size;
+    }
+    return true;
+}
+
+Heap* _create_persistent_heap(int fd, size_t size, void* requested_base) {
+    size_t blocks_size = (size + 128 * 1024 - 1) & ~((size_t)128 * 1024 - 1);
+    size_t length = 128 * 1024 + blocks_size; //first 128KB hold the header and keep the blocks aligned
+    size_t base = (size_t)requested_base;
+    //the address is stored for good, so it must be one the caller reserves in every run - never an ASLR pick
+    if(requested_base == NULL || base % (128 * 1024) != 0) { //buddies are found by address, so blocks must be 128KB aligned
+        return NULL;
+    }
+    //the file carries the creating magic until the header is done, so a failure from here on is created again next time
+    uint64_t creating = PERSISTENT_CREATING_MAGIC;
+    if(ftruncate(fd, 0) == -1 //drops whatever an earlier failed create left
+        || pwrite(fd, &creating, sizeof(creating), offsetof(PersistentHeader, magic)) != (ssize_t)sizeof(creating)
+        || ftruncate(fd, length) == -1) {
+        return NULL;
+    }
+    void* ptr = mmap((void*)base, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0); //never over a caller's mapping
+    if(ptr == MAP_FAILED) {
+        return NULL;
+    }
+    if(ptr != (void*)base) { //kernels without MAP_FIXED_NOREPLACE take the address as a hint
+        munmap(ptr, length);
+        return NULL;
+    }
+    PersistentHeader* header = (PersistentHeader*)ptr; //zero apart from the creating magic, the file was just truncated
+    header->heap.persistent = true;
+    header->chunk.length = length;
+    header->chunk.bottom = (void*)(base + 128 * 1024);
+    header->chunk.num_blocks = blocks_size / (128 * 1024);
+    header->chunk.next = NULL;
+    header->heap.chunks = &header->chunk;
+    header->heap.unformatted = header->chunk.bottom;
+    header->heap.arena_end = (void*)(base + length);
+    header->version = PERSISTENT_VERSION;
+    header->cookie = COOKIE;
+    header->clean = 0;
+    header->base = ptr;
+    header->length = length;
+    header->magic = PERSISTENT_MAGIC; //last, so a half written header is never taken for a finished heap
+    msync(header, 128 * 1024, MS_SYNC);
+    return &header->heap;
+}
+
+bool _unfinished_persistent_heap(int fd) { //a create that failed or crashed before writing the final magic
+    uint64_t magic = 0;
+    if(pread(fd, &magic, sizeof(magic), offsetof(PersistentHeader, magic)) != (ssize_t)sizeof(magic)) {
+        return false; //too short for a header - not ours, leave it alone
+    }
+    return magic == PERSISTENT_CREATING_MAGIC;
+}
+
+Heap* _attach_persistent_heap(int fd, size_t file_size, void* requested_base) {
+    PersistentHeader stored;
+    if(pread(fd, &stored, sizeof(PersistentHeader), 0) != (ssize_t)sizeof(PersistentHeader)) {
+        return NULL;
+    }
+    if(stored.magic != PERSISTENT_MAGIC || stored.version != PERSISTENT_VERSION || stored.length != file_size) {
+        return NULL;
+    }
+    if(requested_base != NULL && requested_base != stored.base) { //the blocks can only live where they were created
+        return NULL;
+    }
+    void* ptr = mmap(stored.base, stored.length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+    if(ptr == MAP_FAILED) {
+        return NULL;
+    }
+    if(ptr != stored.base) { //the address is taken in this process
+        munmap(ptr, stored.length);
+        return NULL;
+    }
+    PersistentHeader* header = (PersistentHeader*)ptr;
+    Heap* heap = &header->heap;
+    if(!header->clean || header->cookie != COOKIE) { //crashed while open, or written by a build with another cookie
+        if(!_rebuild_persistent_heap(heap, header->cookie)) {
+            munmap(ptr, stored.length);
+            return NULL;
+        }
+        header->cookie = COOKIE;
+    }
+    header->clean = 0;
+    msync(header, 128 * 1024, MS_SYNC);
+    return heap;
+}
+
+/**
+ * @brief Opens a heap that lives in the file at ‘path’, so its blocks survive a restart.
+            A new file is created with ‘size’ bytes of blocks (rounded up to 128KB) plus a 128KB header.
+            A heap file whose create failed or crashed before finishing is created again. Any other file
+            that isn't a heap is left untouched.
+            Blocks keep absolute pointers, so the file always lives at the ‘base’ it was created with: pick
+            an address away from where the program, its libraries and mmap land (e.g. 0x600000000000 on
+            x86_64 Linux) and use the same one in every process that opens the file. If the process that had it open
+            crashed, the free lists are rebuilt from the block headers before returning. Only buddy sized
+            blocks can be allocated from it, and sheap_destroy() detaches it without losing the data.
+ * 
+ * @param path The file that backs the heap.
+ * @param size The number of bytes for blocks when the file is created. Ignored for an existing file.
+ * @param base The 128KB aligned address to map the heap at. Required to create a file; NULL reopens an
+ *             existing file at its stored address, anything else must match that address.
+ * @return Heap* 
+ *          i. Success – a handle for the other sheap_* functions.
+            ii. Failure – NULL if the file can't be opened or mapped, is already open (in this or another
+                process), isn't a heap file, is created without a (128KB aligned) ‘base’, its address is
+                already in use in this process or differs from ‘base’, or its block headers are corrupt.
+ */
+Heap* sheap_open(const char* path, size_t size, void* base) {
+    if(path == NULL) {
+        return NULL;
+    }
+    _init_cookie();
+    _load_config();
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if(fd == -1) {
+        return NULL;
+    }
+    if(flock(fd, LOCK_EX | LOCK_NB) == -1) { //two processes with the same file would corrupt each other's lists
+        close(fd);
+        return NULL;
+    }
+    struct stat file_stat;
+    Heap* heap = NULL;
+    if(fstat(fd, &file_stat) == 0) {
+        if(file_stat.st_size == 0 || _unfinished_persistent_heap(fd)) {
+            heap = size == 0 ? NULL : _create_persistent_heap(fd, size, base);
+        }
+        else {
+            heap = _attach_persistent_heap(fd, file_stat.st_size, base);
+        }
+    }
+    if(heap == NULL) {
+        close(fd); //also drops the lock
+        return NULL;
+    }
+    ((PersistentHeader*)heap)->lock_fd = fd; //kept open until sheap_destroy, which releases the lock
+    return heap;
+}
+
+/**
+ * @brief Sets the root object of ‘heap’, the entry point a restarted process finds its data from.
+ * 
+ * @param heap The heap ‘p’ was allocated from.
+ * @param p The root object, or NULL to clear it.
+ */
+void sheap_set_root(Heap* heap, void* p) {
+    if(heap == NULL) {
+        return;
+    }
+    heap->root = p;
+}
+
+/**
+ * @brief Returns the root object of ‘heap’, or NULL if none was set.
+ */
+void* sheap_get_root(Heap* heap) {
+    if(heap == NULL) {
+        return NULL;
+    }
+    return heap->root;
+}
+
 size_t _num_free_blocks() {
-    size_t count = 0;
+    Heap* heap = &global_heap;
+    size_t count = _num_unformatted_blocks(heap);
     for(int i = 0; i < 11; i++) {
-        Metadata* curr = orders[i];
+        Metadata* curr = heap->orders[i];
         while(curr != NULL) {
             _validate_cookie(curr);
             count++;
             curr = curr->next;
         }
+        count += heap->quick_list_sizes[i];
     }
     return count;
 }
 
 size_t _num_free_bytes() {
-    size_t count = 0;
+    Heap* heap = &global_heap;
+    size_t count = _num_unformatted_blocks(heap) * (128 * 1024 - sizeof(Metadata));
     for(int i = 0; i < 11; i++) {
-        Metadata* curr = orders[i];
+        Metadata* curr = heap->orders[i];
+        while(curr != NULL) {
+            _validate_cookie(curr);
+            count += curr->size - sizeof(Metadata);
+            curr = curr->next;
+        }
+        curr = heap->quick_lists[i];
         while(curr != NULL) {
             _validate_cookie(curr);
             count += curr->size - sizeof(Metadata);
@@ -553,22 +1431,24 @@ size_t _num_free_bytes() {
 }
 
 size_t _num_allocated_blocks() {
-    size_t count = 0;
-    Metadata* allocated = allocated_blocks;
+    Heap* heap = &global_heap;
+    size_t count = _num_unformatted_blocks(heap);
+    Metadata* allocated = heap->allocated_blocks;
     while(allocated != NULL) {
         _validate_cookie(allocated);
         count++;
         allocated = allocated->next;
     }
     for(int i = 0; i < 11; i++) {
-        Metadata* curr = orders[i];
+        Metadata* curr = heap->orders[i];
         while(curr != NULL) {
             _validate_cookie(curr);
             count++;
             curr = curr->next;
         }
+        count += heap->quick_list_sizes[i];
     }
-    Metadata* mmap = mmap_head;
+    Metadata* mmap = heap->mmap_head;
     while(mmap != NULL) {
         _validate_cookie(mmap);
         count++;
@@ -578,22 +1458,29 @@ size_t _num_allocated_blocks() {
 }
 
 size_t _num_allocated_bytes() {
-    size_t count = 0;
-    Metadata* allocated = allocated_blocks;
+    Heap* heap = &global_heap;
+    size_t count = _num_unformatted_blocks(heap) * (128 * 1024 - sizeof(Metadata));
+    Metadata* allocated = heap->allocated_blocks;
     while(allocated != NULL) {
         _validate_cookie(allocated);
         count+= allocated->size - sizeof(Metadata);
         allocated = allocated->next;
     }
     for(int i = 0; i < 11; i++) {
-        Metadata* curr = orders[i];
+        Metadata* curr = heap->orders[i];
+        while(curr != NULL) {
+            _validate_cookie(curr);
+            count+= curr->size - sizeof(Metadata);
+            curr = curr->next;
+        }
+        curr = heap->quick_lists[i];
         while(curr != NULL) {
             _validate_cookie(curr);
             count+= curr->size - sizeof(Metadata);
             curr = curr->next;
         }
     }
-    Metadata* mmap = mmap_head;
+    Metadata* mmap = heap->mmap_head;
     while(mmap != NULL) {
         _validate_cookie(mmap);
         count+= mmap->size - sizeof(Metadata);
@@ -0,0 +1,330 @@
+#ifndef MALLOC_ADAPTORS_HPP
+#define MALLOC_ADAPTORS_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory_resource>
+#include <new>
+
+/*
+ * Header-only C++ layer over malloc_3.cpp: a std::pmr::memory_resource, a stateless STL allocator and
+ * (opt-in) sized / aligned replacements of the global operator new and delete.
+ *
+ * Define MALLOC_ADAPTORS_BUMP to build against malloc_1.cpp instead. It only has smalloc, so every
+ * deallocation is a no-op and memory is released when the process exits.
+ *
+ * Define MALLOC_ADAPTORS_REPLACE_NEW in exactly one translation unit before including this header to
+ * route the global operator new and delete through smalloc / sfree.
+ *
+ * malloc_3 takes no locks, so everything here is single-threaded only: don't share a resource or heap
+ * between threads, and don't replace operator new in a process that allocates from more than one thread.
+ */
+
+struct MallocHeap;
+void* smalloc(size_t size);
+#ifndef MALLOC_ADAPTORS_BUMP
+void* sfree(void* p);
+MallocHeap* sheap_create();
+void* sheap_malloc(MallocHeap* heap, size_t size);
+void* sheap_free(MallocHeap* heap, void* p);
+void sheap_reset(MallocHeap* heap);
+void sheap_destroy(MallocHeap* heap);
+MallocHeap* sheap_open(const char* path, size_t size, void* base);
+void sheap_set_root(MallocHeap* heap, void* p);
+void* sheap_get_root(MallocHeap* heap);
+#endif
+
+namespace malloc_adaptors {
+
+#ifdef MALLOC_ADAPTORS_BUMP
+static const size_t NATURAL_ALIGNMENT = 1; //smalloc returns the raw program break
+#else
+static const size_t NATURAL_ALIGNMENT = 16; //48 byte headers after 128 byte (or page) aligned block starts - matches the default new alignment
+#endif
+
+/**
+ * @brief Allocates ‘size’ bytes aligned to ‘alignment’ from ‘heap’, or from the global heap if ‘heap’ is NULL.
+            Alignments above NATURAL_ALIGNMENT over-allocate and keep the original pointer right before
+            the returned one, so the same ‘size’ and ‘alignment’ must be passed to deallocate().
+ *
+ * @return void*
+ *          i. Success – pointer to the first byte of the allocation.
+            ii. Failure – NULL, for the same reasons as smalloc(), or if the padding for ‘alignment’
+                overflows.
+ */
+inline void* allocate(size_t size, size_t alignment, MallocHeap* heap = NULL) {
+    if(size == 0) {
+        size = 1; //C++ wants a unique pointer even for empty allocations
+    }
+#ifdef MALLOC_ADAPTORS_BUMP
+    (void)heap;
+    if(alignment <= NATURAL_ALIGNMENT) {
+        return smalloc(size);
+    }
+    if(size > SIZE_MAX - (alignment - 1)) { //the padded size would wrap around to a tiny block
+        return NULL;
+    }
+    size_t ptr = (size_t)smalloc(size + alignment - 1); //nothing is ever freed, so no need to remember the original pointer
+    if(ptr == 0) {
+        return NULL;
+    }
+    return (void*)((ptr + alignment - 1) & ~(alignment - 1));
+#else
+    if(alignment <= NATURAL_ALIGNMENT) {
+        return heap == NULL ? smalloc(size) : sheap_malloc(heap, size);
+    }
+    if(size > SIZE_MAX - (alignment - 1) - sizeof(void*)) { //the padded size would wrap around to a tiny block
+        return NULL;
+    }
+    size_t total = size + alignment - 1 + sizeof(void*);
+    size_t ptr = (size_t)(heap == NULL ? smalloc(total) : sheap_malloc(heap, total));
+    if(ptr == 0) {
+        return NULL;
+    }
+    size_t aligned = (ptr + sizeof(void*) + alignment - 1) & ~(alignment - 1);
+    *(void**)(aligned - sizeof(void*)) = (void*)ptr;
+    return (void*)aligned;
+#endif
+}
+
+/**
+ * @brief Releases memory returned by allocate() with the same ‘alignment’ and ‘heap’.
+            The alignment decides whether there is an original pointer to recover, so no extra header is read.
+ */
+inline void deallocate(void* p, size_t alignment, MallocHeap* heap = NULL) {
+#ifdef MALLOC_ADAPTORS_BUMP
+    (void)p;
+    (void)alignment;
+    (void)heap;
+#else
+    if(p == NULL) {
+        return;
+    }
+    if(alignment > NATURAL_ALIGNMENT) {
+        p = *(void**)((size_t)p - sizeof(void*));
+    }
+    if(heap == NULL) {
+        sfree(p);
+    }
+    else {
+        sheap_free(heap, p);
+    }
+#endif
+}
+
+/**
+ * @brief std::pmr::memory_resource over the global heap. Use smalloc_resource() for the shared instance.
+ */
+class SmallocResource : public std::pmr::memory_resource {
+protected:
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        void* ptr = malloc_adaptors::allocate(bytes, alignment);
+        if(ptr == NULL) {
+            throw std::bad_alloc();
+        }
+        return ptr;
+    }
+
+    void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+        (void)bytes;
+        malloc_adaptors::deallocate(p, alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return dynamic_cast<const SmallocResource*>(&other) != NULL; //all instances share the global heap
+    }
+};
+
+inline SmallocResource* smalloc_resource() {
+    static SmallocResource resource;
+    return &resource;
+}
+
+#ifndef MALLOC_ADAPTORS_BUMP
+/**
+ * @brief std::pmr::memory_resource that owns a heap from sheap_create(). release() frees everything
+            allocated through it at once (sheap_reset), and the heap is destroyed with the resource.
+ */
+class SheapResource : public std::pmr::memory_resource {
+public:
+    SheapResource() : heap(sheap_create()) {
+        if(heap == NULL) {
+            throw std::bad_alloc();
+        }
+    }
+
+    ~SheapResource() override {
+        sheap_destroy(heap);
+    }
+
+    SheapResource(const SheapResource&) = delete;
+    SheapResource& operator=(const SheapResource&) = delete;
+
+    void release() {
+        sheap_reset(heap);
+    }
+
+    MallocHeap* get_heap() const {
+        return heap;
+    }
+
+protected:
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        void* ptr = malloc_adaptors::allocate(bytes, alignment, heap);
+        if(ptr == NULL) {
+            throw std::bad_alloc();
+        }
+        return ptr;
+    }
+
+    void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+        (void)bytes;
+        malloc_adaptors::deallocate(p, alignment, heap);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+
+private:
+    MallocHeap* heap;
+};
+#endif
+
+/**
+ * @brief Stateless STL allocator over the global heap, e.g. std::vector<int, SmallocAllocator<int>>.
+ */
+template <typename T>
+class SmallocAllocator {
+public:
+    typedef T value_type;
+
+    SmallocAllocator() noexcept {}
+
+    template <typename U>
+    SmallocAllocator(const SmallocAllocator<U>&) noexcept {}
+
+    T* allocate(size_t n) {
+        if(n > (size_t)-1 / sizeof(T)) {
+            throw std::bad_alloc();
+        }
+        void* ptr = malloc_adaptors::allocate(n * sizeof(T), alignof(T));
+        if(ptr == NULL) {
+            throw std::bad_alloc();
+        }
+        return (T*)ptr;
+    }
+
+    void deallocate(T* p, size_t n) noexcept {
+        (void)n;
+        malloc_adaptors::deallocate((void*)p, alignof(T));
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const SmallocAllocator<T>&, const SmallocAllocator<U>&) noexcept {
+    return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const SmallocAllocator<T>&, const SmallocAllocator<U>&) noexcept {
+    return false;
+}
+
+} // namespace malloc_adaptors
+
+#ifdef MALLOC_ADAPTORS_REPLACE_NEW
+/*
+ * Replacements of the global operator new and delete. Plain new gets the default new alignment, which
+ * payloads already have, so it maps straight to smalloc / sfree. Single-threaded processes only.
+ */
+void* operator new(size_t size) {
+    void* ptr = malloc_adaptors::allocate(size, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+    if(ptr == NULL) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    return malloc_adaptors::allocate(size, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return malloc_adaptors::allocate(size, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+
+void* operator new(size_t size, std::align_val_t alignment) {
+    void* ptr = malloc_adaptors::allocate(size, (size_t)alignment);
+    if(ptr == NULL) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void* operator new[](size_t size, std::align_val_t alignment) {
+    return operator new(size, alignment);
+}
+
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return malloc_adaptors::allocate(size, (size_t)alignment);
+}
+
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return malloc_adaptors::allocate(size, (size_t)alignment);
+}
+
+void operator delete(void* p) noexcept {
+    malloc_adaptors::deallocate(p, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+
+void operator delete[](void* p) noexcept {
+    malloc_adaptors::deallocate(p, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    malloc_adaptors::deallocate(p, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+    malloc_adaptors::deallocate(p, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+
+void operator delete(void* p, std::align_val_t alignment) noexcept {
+    malloc_adaptors::deallocate(p, (size_t)alignment);
+}
+
+void operator delete[](void* p, std::align_val_t alignment) noexcept {
+    malloc_adaptors::deallocate(p, (size_t)alignment);
+}
+
+void operator delete(void* p, size_t, std::align_val_t alignment) noexcept {
+    malloc_adaptors::deallocate(p, (size_t)alignment);
+}
+
+void operator delete[](void* p, size_t, std::align_val_t alignment) noexcept {
+    malloc_adaptors::deallocate(p, (size_t)alignment);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept {
+    malloc_adaptors::deallocate(p, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept {
+    malloc_adaptors::deallocate(p, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+
+void operator delete(void* p, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    malloc_adaptors::deallocate(p, (size_t)alignment);
+}
+
+void operator delete[](void* p, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    malloc_adaptors::deallocate(p, (size_t)alignment);
+}
+#endif
+
+#endif // MALLOC_ADAPTORS_HPP